@@ -0,0 +1,214 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../block.h"
+
+/*
+ * Checks journal replay in block.c without mounting anything: a child
+ * process makes changes and dies without unmounting, then the journal of
+ * the disk it left behind is replayed and the blocks are checked.
+ */
+
+/* You need to change this macro to a scratch file; it is overwritten */
+#define DISKPATH "/tmp/pjk151/JOURNALDISK"
+
+/* A small journal at the end of the disk, so a few commits fill it */
+#define J_BLOCKS 16
+#define J_START (DISK_BLOCKS - J_BLOCKS)
+
+/* Commit records, as block.c lays them out */
+#define JOURNAL_COMMIT_MAGIC 0x4A434D54
+
+struct journal_commit {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t length;
+	uint32_t checksum;
+};
+
+#define WRAP_TXNS 22
+
+unsigned char buf[BLOCK_SIZE];
+
+void fill(int block, unsigned char c) {
+	memset(buf, c, BLOCK_SIZE);
+	if (bio_write(block, buf) < 0) {
+		perror("bio_write");
+		_exit(1);
+	}
+}
+
+int holds(int block, unsigned char c) {
+	if (bio_read(block, buf) < 0) {
+		return 0;
+	}
+	return buf[0] == c && buf[BLOCK_SIZE - 1] == c;
+}
+
+/* Make an empty disk with a journal */
+void new_disk() {
+	unlink(DISKPATH);
+	dev_init(DISKPATH);
+	if (dev_journal_create(J_START, J_BLOCKS) < 0) {
+		printf("journal create failure \n");
+		exit(1);
+	}
+	dev_close();
+}
+
+/* Run changes() in a child that opens the disk and then dies mid-mount */
+void crash_after(void (*changes)(void)) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (dev_open(DISKPATH) < 0 || dev_journal_open(J_START, J_BLOCKS) != 1) {
+			_exit(1);
+		}
+		changes();
+		_exit(0);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("child failure \n");
+		exit(1);
+	}
+}
+
+/* Open the disk left behind, replaying its journal */
+void remount() {
+	if (dev_open(DISKPATH) < 0 || dev_journal_open(J_START, J_BLOCKS) != 1) {
+		printf("journal replay failure \n");
+		exit(1);
+	}
+}
+
+void commit_ten() {
+	for (int i = 0; i < 10; i++) {
+		fill(100 + i, 'a' + i);
+	}
+	dev_commit();
+}
+
+void commit_two() {
+	fill(200, 'x');
+	dev_commit();
+	fill(201, 'y');
+	fill(200, 'z');
+	dev_commit();
+}
+
+void log_then_overwrite() {
+	fill(300, 'r');
+	dev_commit();
+
+	/* Written home around the cache, which revokes the logged copy */
+	struct iovec iov = {buf, BLOCK_SIZE};
+	memset(buf, 's', BLOCK_SIZE);
+	bio_writev(300, 1, &iov);
+	dev_commit();
+}
+
+void many_commits() {
+	for (int i = 0; i < WRAP_TXNS; i++) {
+		fill(400 + i % 3, 'A' + i);
+		dev_commit();
+	}
+}
+
+int main(int argc, char **argv) {
+
+	int i;
+
+	/* TEST 1: a committed transaction survives a crash */
+	new_disk();
+	crash_after(commit_ten);
+	remount();
+	for (i = 0; i < 10; i++) {
+		if (!holds(100 + i, 'a' + i)) {
+			printf("TEST 1: Journal replay failure \n");
+			exit(1);
+		}
+	}
+	dev_close();
+	printf("TEST 1: Journal replay Success \n");
+
+
+	/* TEST 2: a torn commit record is ignored, with all of its transaction */
+	new_disk();
+	crash_after(commit_two);
+
+	int fd = open(DISKPATH, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	int last = -1;
+	uint32_t lastSequence = 0;
+	for (i = J_START + 1; i < DISK_BLOCKS; i++) {
+		struct journal_commit *commit = (struct journal_commit *) buf;
+		pread(fd, buf, BLOCK_SIZE, (off_t) i * BLOCK_SIZE);
+		if (commit->magic == JOURNAL_COMMIT_MAGIC && commit->sequence >= lastSequence) {
+			last = i;
+			lastSequence = commit->sequence;
+		}
+	}
+	if (last < 0) {
+		printf("TEST 2: Torn commit failure, no commit record found \n");
+		exit(1);
+	}
+	pread(fd, buf, BLOCK_SIZE, (off_t) last * BLOCK_SIZE);
+	((struct journal_commit *) buf)->checksum ^= 1;
+	pwrite(fd, buf, BLOCK_SIZE, (off_t) last * BLOCK_SIZE);
+	close(fd);
+
+	remount();
+	if (!holds(200, 'x') || !holds(201, 0)) {
+		printf("TEST 2: Torn commit failure \n");
+		exit(1);
+	}
+	dev_close();
+	printf("TEST 2: Torn commit Success \n");
+
+
+	/* TEST 3: a revoked block isn't brought back by replay */
+	new_disk();
+	crash_after(log_then_overwrite);
+	remount();
+	if (!holds(300, 's')) {
+		printf("TEST 3: Journal revoke failure \n");
+		exit(1);
+	}
+	dev_close();
+	printf("TEST 3: Journal revoke Success \n");
+
+
+	/* TEST 4: after the log fills and starts over, only the newest copies replay */
+	new_disk();
+	crash_after(many_commits);
+	remount();
+	for (i = 0; i < 3; i++) {
+		int newest = WRAP_TXNS - 1;
+		while (newest % 3 != i) {
+			newest--;
+		}
+		if (!holds(400 + i, 'A' + newest)) {
+			printf("TEST 4: Journal wraparound failure \n");
+			exit(1);
+		}
+	}
+	dev_close();
+	printf("TEST 4: Journal wraparound Success \n");
+
+	unlink(DISKPATH);
+	printf("Benchmark completed \n");
+	return 0;
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <linux/falloc.h>
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/pjk151/mountdir"
+
+#define BLOCKSIZE 4096
+#define FILEPERM 0666
+
+char buf[BLOCKSIZE];
+
+/* Whether size bytes at offset of fd all read back as c */
+int reads_as(int fd, off_t offset, size_t size, char c) {
+	char data[BLOCKSIZE];
+
+	while (size > 0) {
+		size_t n = (size < BLOCKSIZE) ? size : BLOCKSIZE;
+		if (pread(fd, data, n, offset) != (ssize_t) n) {
+			return 0;
+		}
+		for (size_t i = 0; i < n; i++) {
+			if (data[i] != c) {
+				return 0;
+			}
+		}
+		offset += n;
+		size -= n;
+	}
+	return 1;
+}
+
+/* Fill blocks [first, first + count) of fd with c */
+int fill_blocks(int fd, int first, int count, char c) {
+	memset(buf, c, BLOCKSIZE);
+	for (int i = 0; i < count; i++) {
+		if (pwrite(fd, buf, BLOCKSIZE, (off_t) (first + i) * BLOCKSIZE) != BLOCKSIZE) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	int fd = 0;
+	struct stat st;
+	blkcnt_t before;
+
+	if ((fd = open(TESTDIR "/sparse", O_CREAT | O_RDWR | O_TRUNC, FILEPERM)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+
+	/* TEST 1: shrinking then growing a file reads zeros in between */
+	if (fill_blocks(fd, 0, 4, 'a') < 0 || ftruncate(fd, BLOCKSIZE + 100) < 0 ||
+	    ftruncate(fd, 4 * BLOCKSIZE) < 0) {
+		perror("ftruncate");
+		printf("TEST 1: Truncate failure \n");
+		exit(1);
+	}
+
+	fstat(fd, &st);
+	if (st.st_size != 4 * BLOCKSIZE || !reads_as(fd, 0, BLOCKSIZE + 100, 'a') ||
+	    !reads_as(fd, BLOCKSIZE + 100, 3 * BLOCKSIZE - 100, 0)) {
+		printf("TEST 1: Truncate failure \n");
+		exit(1);
+	}
+	printf("TEST 1: Truncate Success \n");
+
+
+	/* TEST 2: a punched range reads zeros and gives its blocks back */
+	if (fill_blocks(fd, 0, 8, 'b') < 0) {
+		perror("pwrite");
+		exit(1);
+	}
+	fsync(fd);
+	fstat(fd, &st);
+	before = st.st_blocks;
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 2 * BLOCKSIZE + 10, 4 * BLOCKSIZE) < 0) {
+		perror("fallocate");
+		printf("TEST 2: Punch hole failure \n");
+		exit(1);
+	}
+
+	fstat(fd, &st);
+	if (st.st_size != 8 * BLOCKSIZE || st.st_blocks >= before ||
+	    !reads_as(fd, 0, 2 * BLOCKSIZE + 10, 'b') ||
+	    !reads_as(fd, 2 * BLOCKSIZE + 10, 4 * BLOCKSIZE, 0) ||
+	    !reads_as(fd, 6 * BLOCKSIZE + 10, 2 * BLOCKSIZE - 10, 'b')) {
+		printf("TEST 2: Punch hole failure \n");
+		exit(1);
+	}
+	printf("TEST 2: Punch hole Success \n");
+
+
+	/* TEST 3: a write past the end leaves a hole that reads as zeros */
+	if (ftruncate(fd, 0) < 0 || fill_blocks(fd, 100, 1, 'c') < 0) {
+		perror("pwrite");
+		printf("TEST 3: Sparse write failure \n");
+		exit(1);
+	}
+	fsync(fd);
+
+	fstat(fd, &st);
+	if (st.st_size != 101 * BLOCKSIZE || st.st_blocks * 512 >= 10 * BLOCKSIZE ||
+	    !reads_as(fd, 0, 100 * BLOCKSIZE, 0) || !reads_as(fd, 100 * BLOCKSIZE, BLOCKSIZE, 'c')) {
+		printf("TEST 3: Sparse write failure \n");
+		exit(1);
+	}
+	printf("TEST 3: Sparse write Success \n");
+
+
+	/* TEST 4: KEEP_SIZE preallocation takes blocks without changing the size */
+	fstat(fd, &st);
+	before = st.st_blocks;
+
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 200 * BLOCKSIZE) < 0) {
+		perror("fallocate");
+		printf("TEST 4: Preallocate failure \n");
+		exit(1);
+	}
+
+	fstat(fd, &st);
+	if (st.st_size != 101 * BLOCKSIZE || st.st_blocks * 512 < before * 512 + 199 * BLOCKSIZE ||
+	    !reads_as(fd, 0, 100 * BLOCKSIZE, 0) || !reads_as(fd, 100 * BLOCKSIZE, BLOCKSIZE, 'c')) {
+		printf("TEST 4: Preallocate failure \n");
+		exit(1);
+	}
+
+	/* Nothing can be read past the end, preallocated or not */
+	if (pread(fd, buf, BLOCKSIZE, 150 * BLOCKSIZE) != 0) {
+		printf("TEST 4: Preallocate failure \n");
+		exit(1);
+	}
+	printf("TEST 4: Preallocate Success \n");
+
+
+	close(fd);
+	if (unlink(TESTDIR "/sparse") < 0) {
+		perror("unlink");
+		exit(1);
+	}
+
+	printf("Benchmark completed \n");
+	return 0;
+}
@@ -9,21 +9,447 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+// <linux/fs.h>, pulled in by io_uring.h, has its own 1KB BLOCK_SIZE.
+#undef BLOCK_SIZE
 
 #include "block.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+//Most iovecs a single preadv/pwritev accepts
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//Number of hash buckets used to look up cached blocks
+#define CACHE_HASH_SIZE	2048
 
 int diskfile = -1;
 
+/*
+ * Device backends
+ *
+ * DEV_BACKEND_PREAD moves blocks with pread/pwrite through the block cache
+ * below. DEV_BACKEND_MMAP maps the whole disk file instead: blocks are copied
+ * to and from the mapping (or handed out directly by bio_map) without a
+ * system call, and the page cache takes the place of the block cache.
+ */
+static int backend = DEV_BACKEND_PREAD;
+static unsigned char *diskmap = NULL;
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring submission and completion rings for DEV_BACKEND_URING, set up
+ * with the raw system calls. Only bio_batch requests use the ring; single
+ * block reads and writes stay on the block cache.
+ */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static struct uring ring = { .fd = -1 };
+
+// Completions are matched to requests by index, so one batch uses the ring
+// at a time: from its first submit until bio_batch_wait() has reaped it.
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Block buffer cache
+ *
+ * Every bio_read/bio_write goes through a fixed number of in-memory block
+ * slots. Slots are found by hashing the block number and are kept on an LRU
+ * list (most recently used at the head). Writes only mark the slot dirty; a
+ * dirty block reaches the disk file when it is evicted or when dev_flush()
+ * is called (flush, fsync and unmount). With a journal, see below.
+ */
+struct cache_block {
+	int block_num;				/* on-disk block number, -1 if unused */
+	int dirty;				/* block differs from the disk copy */
+	int logged;				/* the dirty contents are in the journal */
+	struct cache_block *extra_next;		/* next slot added past cache_size */
+	struct cache_block *hash_next;		/* next block in the same hash bucket */
+	struct cache_block *lru_prev;		/* more recently used neighbour */
+	struct cache_block *lru_next;		/* less recently used neighbour */
+	unsigned char data[BLOCK_SIZE];
+};
+
+static int cache_size = BLOCK_CACHE_SIZE;
+static struct cache_block *cache_slots = NULL;
+static struct cache_block *cache_extra = NULL;
+static struct cache_block *cache_hash[CACHE_HASH_SIZE];
+static struct cache_block *lru_head = NULL;
+static struct cache_block *lru_tail = NULL;
+static struct cache_stats stats;
+static unsigned long home_writes = 0;		/* cached blocks written home or invalidated */
+
+/*
+ * cache_lock covers the cache slots, hash, LRU list and stats. Runs read or
+ * written straight to the disk file are done without it.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Journal state, also under cache_lock (see "Metadata journal" below).
+ * journal_start is 0 when no journal is in use; every dirty block may then
+ * be written home whenever the cache likes.
+ */
+static int journal_start = 0;			/* header block; the log follows it */
+static int journal_wanted = 1;			/* dev_journal_open() does more than replay */
+static int journal_blocks = 0;			/* header and log */
+static int journal_next = 1;			/* log block the next transaction goes to */
+static uint32_t journal_sequence = 0;		/* sequence number of the next transaction */
+static int journal_pending = 0;			/* dirty blocks not in the log yet */
+static unsigned char journal_logged[DISK_BLOCKS / 8];	/* blocks with a copy in the log */
+static unsigned char journal_revoked[DISK_BLOCKS / 8];	/* revoked by the next transaction */
+static int *revoke_list = NULL;
+static int revoke_count = 0;
+static int revoke_capacity = 0;
+
+static int block_bit(const unsigned char *bits, int block_num) {
+	return bits[block_num / 8] & (1 << (block_num & 7));
+}
+
+//A dirty block the log doesn't have yet, which must not be written home
+static int cache_pinned(struct cache_block *cb) {
+	return journal_start > 0 && cb->dirty && !cb->logged;
+}
+
+//Note that block_num is about to be overwritten at home without the log
+static int journal_revoke(int block_num) {
+	if (journal_start == 0 || !block_bit(journal_logged, block_num) || block_bit(journal_revoked, block_num)) {
+		return 0;
+	}
+
+	if (revoke_count == revoke_capacity) {
+		int capacity = (revoke_capacity == 0) ? 64 : revoke_capacity * 2;
+		int *list = realloc(revoke_list, capacity * sizeof(int));
+		if (list == NULL) {
+			perror("journal revoke failed");
+			return -1;
+		}
+		revoke_list = list;
+		revoke_capacity = capacity;
+	}
+	revoke_list[revoke_count++] = block_num;
+	journal_revoked[block_num / 8] |= 1 << (block_num & 7);
+	return 0;
+}
+
+static int cache_hash_index(int block_num) {
+	return (unsigned int) block_num % CACHE_HASH_SIZE;
+}
+
+static void lru_unlink(struct cache_block *cb) {
+	if (cb->lru_prev) cb->lru_prev->lru_next = cb->lru_next;
+	else lru_head = cb->lru_next;
+	if (cb->lru_next) cb->lru_next->lru_prev = cb->lru_prev;
+	else lru_tail = cb->lru_prev;
+	cb->lru_prev = cb->lru_next = NULL;
+}
+
+static void lru_push_front(struct cache_block *cb) {
+	cb->lru_prev = NULL;
+	cb->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = cb;
+	lru_head = cb;
+	if (lru_tail == NULL) lru_tail = cb;
+}
+
+static void hash_remove(struct cache_block *cb) {
+	struct cache_block **link = &cache_hash[cache_hash_index(cb->block_num)];
+	while (*link != NULL) {
+		if (*link == cb) {
+			*link = cb->hash_next;
+			break;
+		}
+		link = &(*link)->hash_next;
+	}
+	cb->hash_next = NULL;
+}
+
+static void hash_insert(struct cache_block *cb) {
+	int index = cache_hash_index(cb->block_num);
+	cb->hash_next = cache_hash[index];
+	cache_hash[index] = cb;
+}
+
+static struct cache_block *cache_lookup(int block_num) {
+	struct cache_block *cb = cache_hash[cache_hash_index(block_num)];
+	while (cb != NULL && cb->block_num != block_num) {
+		cb = cb->hash_next;
+	}
+	return cb;
+}
+
+//Write a cached block back to the disk file
+static int cache_writeback(struct cache_block *cb) {
+	int retstat = pwrite(diskfile, cb->data, BLOCK_SIZE, (off_t) cb->block_num * BLOCK_SIZE);
+	if (retstat < 0) {
+		perror("block_write failed");
+		return retstat;
+	}
+	if (cache_pinned(cb)) {
+		journal_pending--;
+	}
+	cb->dirty = 0;
+	cb->logged = 0;
+	stats.writebacks++;
+	home_writes++;
+	return retstat;
+}
+
+//Allocate the cache slots on first use
+static int cache_setup() {
+	if (cache_slots != NULL) {
+		return 0;
+	}
+
+	cache_slots = calloc(cache_size, sizeof(struct cache_block));
+	if (cache_slots == NULL) {
+		perror("block cache allocation failed");
+		return -1;
+	}
+
+	memset(cache_hash, 0, sizeof(cache_hash));
+	memset(&stats, 0, sizeof(stats));
+	lru_head = lru_tail = NULL;
+	for (int i = 0; i < cache_size; i++) {
+		cache_slots[i].block_num = -1;
+		lru_push_front(&cache_slots[i]);
+	}
+	return 0;
+}
+
+/*
+ * Take the least recently used slot for block_num. A dirty victim is written
+ * back first. The returned slot is hashed under block_num and sits at the
+ * head of the LRU list; its data is left for the caller to fill in.
+ */
+static struct cache_block *cache_claim(int block_num) {
+	struct cache_block *cb = lru_tail;
+
+	// Blocks waiting for the next commit stay; if nothing else is left,
+	// the cache grows by a slot.
+	while (cb != NULL && cache_pinned(cb)) {
+		cb = cb->lru_prev;
+	}
+	if (cb == NULL) {
+		cb = calloc(1, sizeof(struct cache_block));
+		if (cb == NULL) {
+			perror("block cache allocation failed");
+			return NULL;
+		}
+		cb->block_num = -1;
+		cb->extra_next = cache_extra;
+		cache_extra = cb;
+		lru_push_front(cb);
+	}
+
+	if (cb->block_num >= 0) {
+		if (cb->dirty && cache_writeback(cb) < 0) {
+			return NULL;
+		}
+		hash_remove(cb);
+		stats.evictions++;
+	}
+
+	cb->block_num = block_num;
+	cb->dirty = 0;
+	cb->logged = 0;
+	hash_insert(cb);
+	lru_unlink(cb);
+	lru_push_front(cb);
+	return cb;
+}
+
+//Drop a cached block without writing it back
+static void cache_invalidate(struct cache_block *cb) {
+	if (cache_pinned(cb)) {
+		journal_pending--;
+	}
+	hash_remove(cb);
+	cb->block_num = -1;
+	cb->dirty = 0;
+	cb->logged = 0;
+	home_writes++;
+	lru_unlink(cb);
+
+	// Put the free slot at the tail so it is the next one reused.
+	cb->lru_prev = lru_tail;
+	if (lru_tail) lru_tail->lru_next = cb;
+	lru_tail = cb;
+	if (lru_head == NULL) lru_head = cb;
+}
+
+static void cache_teardown() {
+	while (cache_extra != NULL) {
+		struct cache_block *next = cache_extra->extra_next;
+		free(cache_extra);
+		cache_extra = next;
+	}
+	free(cache_slots);
+	cache_slots = NULL;
+	free(revoke_list);
+	revoke_list = NULL;
+	revoke_count = revoke_capacity = 0;
+	journal_start = 0;
+	journal_pending = 0;
+	memset(cache_hash, 0, sizeof(cache_hash));
+	lru_head = lru_tail = NULL;
+}
+
+//Set the number of blocks the cache holds. Only takes effect before the disk is opened.
+void dev_set_cache_size(int nblocks) {
+	if (cache_slots == NULL && nblocks > 0) {
+		cache_size = nblocks;
+	}
+}
+
+//Choose the backend used by the next dev_init/dev_open
+void dev_set_backend(int which) {
+	if (diskfile < 0) {
+		backend = which;
+	}
+}
+
+//Choose whether the next dev_journal_open keeps logging after its replay
+void dev_set_journaling(int on) {
+	journal_wanted = on;
+}
+
+#ifdef HAVE_IO_URING
+static void uring_teardown() {
+	if (ring.sqes != NULL) munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_ring_size);
+	if (ring.sq_ring != NULL) munmap(ring.sq_ring, ring.sq_ring_size);
+	if (ring.fd >= 0) close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+//Create the rings. Fails on kernels (or sandboxes) without io_uring.
+static int uring_setup() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring.fd = syscall(__NR_io_uring_setup, BIO_BATCH_MAX, &params);
+	if (ring.fd < 0) {
+		return -1;
+	}
+
+	ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_ring_size > ring.sq_ring_size) ring.sq_ring_size = ring.cq_ring_size;
+		ring.cq_ring_size = ring.sq_ring_size;
+	}
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			    ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED) {
+		ring.sq_ring = NULL;
+		uring_teardown();
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ring = ring.sq_ring;
+	} else {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				    ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED) {
+			ring.cq_ring = NULL;
+			uring_teardown();
+			return -1;
+		}
+	}
+
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		uring_teardown();
+		return -1;
+	}
+
+	unsigned char *sq = ring.sq_ring, *cq = ring.cq_ring;
+	ring.sq_head  = (unsigned *) (sq + params.sq_off.head);
+	ring.sq_tail  = (unsigned *) (sq + params.sq_off.tail);
+	ring.sq_mask  = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring.cq_head  = (unsigned *) (cq + params.cq_off.head);
+	ring.cq_tail  = (unsigned *) (cq + params.cq_off.tail);
+	ring.cq_mask  = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring.cqes     = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	return 0;
+}
+#endif
+
+//Report the backend actually in use
+int dev_get_backend() {
+	if (diskmap != NULL) return DEV_BACKEND_MMAP;
+#ifdef HAVE_IO_URING
+	if (ring.fd >= 0) return DEV_BACKEND_URING;
+#endif
+	return DEV_BACKEND_PREAD;
+}
+
+//Set up the chosen backend for the open disk file, falling back to pread
+static int dev_attach() {
+	if (backend == DEV_BACKEND_MMAP) {
+		struct stat st;
+		if (fstat(diskfile, &st) == 0 && st.st_size >= DISK_SIZE) {
+			void *map = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+			if (map != MAP_FAILED) {
+				diskmap = map;
+				return 0;
+			}
+			perror("disk mmap failed, using pread");
+		} else {
+			fprintf(stderr, "disk file is smaller than the disk, using pread\n");
+		}
+	}
+
+	if (backend == DEV_BACKEND_URING) {
+#ifdef HAVE_IO_URING
+		if (uring_setup() < 0) {
+			perror("io_uring setup failed, using pread");
+		}
+#else
+		fprintf(stderr, "built without io_uring support, using pread\n");
+#endif
+	}
+	return cache_setup();
+}
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
@@ -37,6 +463,10 @@ void dev_init(const char* diskfile_path) {
     }
 	
     ftruncate(diskfile, DISK_SIZE);
+
+    if (dev_attach() < 0) {
+		exit(EXIT_FAILURE);
+    }
 }
 
 //Function to open the disk file
@@ -50,35 +480,1054 @@ int dev_open(const char* diskfile_path) {
 		  perror("disk_open failed");
 		  return -1;
     }
+
+    if (dev_attach() < 0) {
+		  close(diskfile);
+		  diskfile = -1;
+		  return -1;
+    }
 	return 0;
 }
 
+//Write every dirty cached block the journal doesn't hold back to the disk file
+int dev_flush() {
+    int retstat = 0;
+
+    if (diskmap != NULL) {
+		if (msync(diskmap, DISK_SIZE, MS_SYNC) < 0) {
+			perror("disk msync failed");
+			return -1;
+		}
+		return 0;
+    }
+
+    if (cache_slots == NULL) {
+		return 0;
+    }
+
+    // Dirty blocks are written independently so one failure doesn't keep
+    // the rest from reaching the disk.
+    pthread_mutex_lock(&cache_lock);
+    for (struct cache_block *cb = lru_head; cb != NULL; cb = cb->lru_next) {
+		if (cb->block_num >= 0 && cb->dirty && !cache_pinned(cb)) {
+			if (cache_writeback(cb) < 0) {
+				retstat = -1;
+			}
+		}
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return retstat;
+}
+
 void dev_close() {
     if (diskfile >= 0) {
+		if (journal_start > 0) {
+			dev_commit();
+			dev_checkpoint(1);
+		} else {
+			dev_flush();
+		}
+		if (diskmap != NULL) {
+			munmap(diskmap, DISK_SIZE);
+			diskmap = NULL;
+		}
+#ifdef HAVE_IO_URING
+		uring_teardown();
+#endif
 		close(diskfile);
+		diskfile = -1;
+    }
+    cache_teardown();
+}
+
+//Copy out the cache hit/miss counters
+void dev_cache_stats(struct cache_stats *out) {
+    pthread_mutex_lock(&cache_lock);
+    memcpy(out, &stats, sizeof(struct cache_stats));
+    pthread_mutex_unlock(&cache_lock);
+}
+
+//Address of a block inside the mapped disk, or NULL when not using mmap
+void *bio_map(const int block_num) {
+    if (diskmap == NULL || block_num < 0 || block_num >= DISK_BLOCKS) {
+		return NULL;
+    }
+    return diskmap + (size_t) block_num * BLOCK_SIZE;
+}
+
+/*
+ * Hand out the disk file itself for count blocks starting at block_num, so
+ * they can be spliced to or from it. Dirty cached copies are written back
+ * first for reading, and dropped for writing since the caller overwrites
+ * them. Returns the file descriptor, with the run's byte offset in *pos.
+ */
+int bio_fd(const int block_num, const int count, int writing, off_t *pos) {
+    if (diskfile < 0 || block_num < 0 || block_num + count > DISK_BLOCKS) {
+		return -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count && cache_slots != NULL; i++) {
+		if (writing && journal_revoke(block_num + i) < 0) {
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+		struct cache_block *cb = cache_lookup(block_num + i);
+		if (cb == NULL) {
+			continue;
+		}
+		if (writing) {
+			cache_invalidate(cb);
+		} else if (cb->dirty && cache_writeback(cb) < 0) {
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
     }
+    pthread_mutex_unlock(&cache_lock);
+
+    *pos = (off_t) block_num * BLOCK_SIZE;
+    return diskfile;
+}
+
+/*
+ * Start reading count blocks from block_num in the background and return at
+ * once. They land in the disk file's page cache, which is where whole blocks
+ * are spliced from and where the pread backend finds them afterwards.
+ */
+int bio_prefetch(const int block_num, const int count) {
+    if (diskfile < 0 || block_num < 0 || count <= 0 || block_num + count > DISK_BLOCKS) {
+		return -1;
+    }
+
+    if (diskmap != NULL) {
+		return madvise(diskmap + (size_t) block_num * BLOCK_SIZE, (size_t) count * BLOCK_SIZE, MADV_WILLNEED);
+    }
+    if (posix_fadvise(diskfile, (off_t) block_num * BLOCK_SIZE, (off_t) count * BLOCK_SIZE, POSIX_FADV_WILLNEED) != 0) {
+		return -1;
+    }
+    return 0;
 }
 
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
+
+    if (diskmap != NULL) {
+		void *block = bio_map(block_num);
+		if (block == NULL) {
+			memset (buf, 0, BLOCK_SIZE);
+			fprintf(stderr, "block_read failed: block %d is outside the disk\n", block_num);
+			return -1;
+		}
+		memcpy(buf, block, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_lookup(block_num);
+
+    if (cb != NULL) {
+		stats.hits++;
+		lru_unlink(cb);
+		lru_push_front(cb);
+		memcpy(buf, cb->data, BLOCK_SIZE);
+		pthread_mutex_unlock(&cache_lock);
+		return BLOCK_SIZE;
     }
 
+    // A miss is read without the lock, so other lookups don't wait for
+    // the disk. Should the block be cached meanwhile, or cached, written
+    // home and dropped, what we read may be out of date.
+    stats.misses++;
+    while (cb == NULL) {
+		unsigned long writes = home_writes;
+		pthread_mutex_unlock(&cache_lock);
+
+		retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
+		if (retstat < 0) {
+			perror("block_read failed");
+			memset (buf, 0, BLOCK_SIZE);
+			return retstat;
+		}
+		if (retstat < BLOCK_SIZE) {
+			memset ((char *) buf + retstat, 0, BLOCK_SIZE - retstat);
+		}
+
+		pthread_mutex_lock(&cache_lock);
+		cb = cache_lookup(block_num);
+		if (cb != NULL) {
+			memcpy(buf, cb->data, BLOCK_SIZE);
+			retstat = BLOCK_SIZE;
+		} else if (home_writes == writes) {
+			// Without a free slot the block just isn't cached.
+			cb = cache_claim(block_num);
+			if (cb == NULL) {
+				break;
+			}
+			memcpy(cb->data, buf, BLOCK_SIZE);
+		}
+    }
+    pthread_mutex_unlock(&cache_lock);
     return retstat;
 }
 
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
+    if (diskmap != NULL) {
+		void *block = bio_map(block_num);
+		if (block == NULL) {
+			fprintf(stderr, "block_write failed: block %d is outside the disk\n", block_num);
+			return -1;
+		}
+		memcpy(block, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
     }
-    return retstat;
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_lookup(block_num);
+
+    if (cb != NULL) {
+		stats.hits++;
+		lru_unlink(cb);
+		lru_push_front(cb);
+
+		// The logged contents may go home at any time, the new ones only
+		// once they are logged too.
+		if (cb->dirty && cb->logged && cache_writeback(cb) < 0) {
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+    } else {
+		// The whole block is overwritten, so there is no need to read it first.
+		stats.misses++;
+		cb = cache_claim(block_num);
+		if (cb == NULL) {
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+    }
+
+    if (journal_start > 0 && !cb->dirty) {
+		journal_pending++;
+    }
+    memcpy(cb->data, buf, BLOCK_SIZE);
+    cb->dirty = 1;
+    pthread_mutex_unlock(&cache_lock);
+    return BLOCK_SIZE;
+}
+
+//Zero the part of a read run past the bytes actually read (end of the disk file)
+static void zero_short_read(int count, const struct iovec *iov, ssize_t got) {
+    for (int i = got / BLOCK_SIZE; i < count; i++) {
+		int skip = (i == got / BLOCK_SIZE) ? got % BLOCK_SIZE : 0;
+		memset((char *) iov[i].iov_base + skip, 0, BLOCK_SIZE - skip);
+    }
+}
+
+//Write count consecutive blocks with as few pwritev calls as possible
+static int dev_pwritev(int block_num, int count, const struct iovec *iov) {
+    int done = 0;
+
+    while (done < count) {
+		int batch = count - done;
+		if (batch > IOV_MAX) batch = IOV_MAX;
+
+		ssize_t retstat = pwritev(diskfile, iov + done, batch, (off_t) (block_num + done) * BLOCK_SIZE);
+		if (retstat < (ssize_t) batch * BLOCK_SIZE) {
+			perror("block_writev failed");
+			return -1;
+		}
+		done += batch;
+    }
+    return 0;
+}
+
+//Read count consecutive blocks with as few preadv calls as possible
+static int dev_preadv(int block_num, int count, const struct iovec *iov) {
+    int done = 0;
+
+    while (done < count) {
+		int batch = count - done;
+		if (batch > IOV_MAX) batch = IOV_MAX;
+
+		ssize_t retstat = preadv(diskfile, iov + done, batch, (off_t) (block_num + done) * BLOCK_SIZE);
+		if (retstat < 0) {
+			perror("block_readv failed");
+			return -1;
+		}
+
+		// Anything past the end of the disk file reads back as zeros.
+		if (retstat < (ssize_t) batch * BLOCK_SIZE) {
+			zero_short_read(batch, iov + done, retstat);
+		}
+		done += batch;
+    }
+    return 0;
+}
+
+/*
+ * Read count consecutive blocks starting at block_num. iov holds one
+ * BLOCK_SIZE buffer per block. Blocks already in the cache are copied from
+ * it; the rest are read straight into the caller's buffers without being
+ * cached, so streaming reads don't push metadata out of the cache.
+ */
+int bio_readv(const int block_num, const int count, const struct iovec *iov) {
+    int i = 0;
+
+    if (diskmap != NULL) {
+		for (i = 0; i < count; i++) {
+			if (bio_read(block_num + i, iov[i].iov_base) < 0) {
+				return -1;
+			}
+		}
+		return count * BLOCK_SIZE;
+    }
+
+    while (i < count) {
+		pthread_mutex_lock(&cache_lock);
+		struct cache_block *cb = cache_lookup(block_num + i);
+		if (cb != NULL) {
+			stats.hits++;
+			memcpy(iov[i].iov_base, cb->data, BLOCK_SIZE);
+			pthread_mutex_unlock(&cache_lock);
+			i++;
+			continue;
+		}
+
+		// Gather the uncached stretch and read it in one go.
+		int runStart = i;
+		while (i < count && cache_lookup(block_num + i) == NULL) {
+			i++;
+		}
+		stats.misses += i - runStart;
+		pthread_mutex_unlock(&cache_lock);
+		if (dev_preadv(block_num + runStart, i - runStart, iov + runStart) < 0) {
+			return -1;
+		}
+    }
+    return count * BLOCK_SIZE;
+}
+
+/*
+ * Write count consecutive blocks starting at block_num from one BLOCK_SIZE
+ * buffer per block. The run goes straight to the disk file; cached copies of
+ * these blocks are dropped since they are entirely overwritten.
+ */
+int bio_writev(const int block_num, const int count, const struct iovec *iov) {
+    if (diskmap != NULL) {
+		for (int i = 0; i < count; i++) {
+			if (bio_write(block_num + i, iov[i].iov_base) < 0) {
+				return -1;
+			}
+		}
+		return count * BLOCK_SIZE;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count; i++) {
+		if (journal_revoke(block_num + i) < 0) {
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+		struct cache_block *cb = cache_lookup(block_num + i);
+		if (cb != NULL) {
+			cache_invalidate(cb);
+		}
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (dev_pwritev(block_num, count, iov) < 0) {
+		return -1;
+    }
+    return count * BLOCK_SIZE;
+}
+
+/*
+ * Batched block I/O
+ *
+ * A bio_batch collects runs of blocks to read or write and issues them
+ * together: callers queue runs with bio_batch_readv/bio_batch_writev, start
+ * them with bio_batch_submit and block in bio_batch_wait until all are done.
+ * With DEV_BACKEND_URING every queued run is one io_uring request and the
+ * whole batch is submitted with a single system call. Otherwise each run is
+ * done with preadv/pwritev at submit time. The block cache is honoured the
+ * same way as in bio_readv/bio_writev.
+ */
+void bio_batch_init(struct bio_batch *batch) {
+    batch->count = 0;
+    batch->submitted = 0;
+    batch->inflight = 0;
+    batch->error = 0;
+}
+
+//Queue one run of at most IOV_MAX uncached blocks, draining a full batch first
+static int batch_queue(struct bio_batch *batch, int block_num, int count, const struct iovec *iov, int writing) {
+    if (batch->count == BIO_BATCH_MAX) {
+		bio_batch_submit(batch);
+		if (bio_batch_wait(batch) < 0) {
+			return -1;
+		}
+    }
+
+    batch->reqs[batch->count].block_num = block_num;
+    batch->reqs[batch->count].nblocks   = count;
+    batch->reqs[batch->count].iov       = iov;
+    batch->reqs[batch->count].writing   = writing;
+    batch->count++;
+    return 0;
+}
+
+static int batch_queue_run(struct bio_batch *batch, int block_num, int count, const struct iovec *iov, int writing) {
+    for (int done = 0; done < count; done += IOV_MAX) {
+		int n = (count - done > IOV_MAX) ? IOV_MAX : count - done;
+		if (batch_queue(batch, block_num + done, n, iov + done, writing) < 0) {
+			return -1;
+		}
+    }
+    return 0;
+}
+
+int bio_batch_readv(struct bio_batch *batch, const int block_num, const int count, const struct iovec *iov) {
+    int i = 0;
+
+    // The mapping is already in memory; there is nothing to wait for.
+    if (diskmap != NULL) {
+		return bio_readv(block_num, count, iov);
+    }
+
+    while (i < count) {
+		pthread_mutex_lock(&cache_lock);
+		struct cache_block *cb = cache_lookup(block_num + i);
+		if (cb != NULL) {
+			stats.hits++;
+			memcpy(iov[i].iov_base, cb->data, BLOCK_SIZE);
+			pthread_mutex_unlock(&cache_lock);
+			i++;
+			continue;
+		}
+
+		int runStart = i;
+		while (i < count && cache_lookup(block_num + i) == NULL) {
+			i++;
+		}
+		stats.misses += i - runStart;
+		pthread_mutex_unlock(&cache_lock);
+		if (batch_queue_run(batch, block_num + runStart, i - runStart, iov + runStart, 0) < 0) {
+			return -1;
+		}
+    }
+    return 0;
+}
+
+int bio_batch_writev(struct bio_batch *batch, const int block_num, const int count, const struct iovec *iov) {
+    if (diskmap != NULL) {
+		return bio_writev(block_num, count, iov);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count; i++) {
+		if (journal_revoke(block_num + i) < 0) {
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+		struct cache_block *cb = cache_lookup(block_num + i);
+		if (cb != NULL) {
+			cache_invalidate(cb);
+		}
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return batch_queue_run(batch, block_num, count, iov, 1);
+}
+
+//Do requests [from, count) with preadv/pwritev
+static void batch_run_sync(struct bio_batch *batch, int from) {
+    for (int r = from; r < batch->count; r++) {
+		int ret = batch->reqs[r].writing
+			? dev_pwritev(batch->reqs[r].block_num, batch->reqs[r].nblocks, batch->reqs[r].iov)
+			: dev_preadv(batch->reqs[r].block_num, batch->reqs[r].nblocks, batch->reqs[r].iov);
+		if (ret < 0) {
+			batch->error = 1;
+		}
+    }
+}
+
+//Start every queued request that hasn't been started yet
+int bio_batch_submit(struct bio_batch *batch) {
+#ifdef HAVE_IO_URING
+    if (ring.fd >= 0) {
+		if (batch->submitted == 0 && batch->count > 0) {
+			pthread_mutex_lock(&ring_lock);
+		}
+		unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		unsigned tail = *ring.sq_tail;
+		int queued = batch->count - batch->submitted;
+
+		for (int r = batch->submitted; r < batch->count; r++) {
+			unsigned index = tail & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[index];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode    = batch->reqs[r].writing ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd        = diskfile;
+			sqe->off       = (off_t) batch->reqs[r].block_num * BLOCK_SIZE;
+			sqe->addr      = (unsigned long) batch->reqs[r].iov;
+			sqe->len       = batch->reqs[r].nblocks;
+			sqe->user_data = r;
+			ring.sq_array[index] = index;
+			tail++;
+		}
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		while (queued > 0) {
+			int ret = syscall(__NR_io_uring_enter, ring.fd, queued, 0, 0, NULL, 0);
+			if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+			if (ret < 0) {
+				perror("io_uring submit failed");
+				break;
+			}
+			queued -= ret;
+		}
+
+		/*
+		 * Whatever the kernel didn't take is pulled back off the ring, so
+		 * a later submit can't start it under someone else's user_data,
+		 * and done here instead.
+		 */
+		int taken = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) - head;
+		batch->inflight += taken;
+		if (queued > 0) {
+			__atomic_store_n(ring.sq_tail, head + taken, __ATOMIC_RELEASE);
+			batch_run_sync(batch, batch->submitted + taken);
+		}
+		batch->submitted = batch->count;
+		return batch->error ? -1 : 0;
+    }
+#endif
+
+    // No ring: do each request now, so waiting has nothing left to do.
+    batch_run_sync(batch, batch->submitted);
+    batch->submitted = batch->count;
+    return batch->error ? -1 : 0;
+}
+
+//Wait for every submitted request, then empty the batch
+int bio_batch_wait(struct bio_batch *batch) {
+    int error = batch->error;
+
+#ifdef HAVE_IO_URING
+    if (ring.fd >= 0) {
+		int pending = batch->inflight;
+
+		while (pending > 0) {
+			unsigned head = *ring.cq_head;
+
+			// Reap everything that has completed so far.
+			while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+				int r = cqe->user_data;
+				ssize_t expected = (ssize_t) batch->reqs[r].nblocks * BLOCK_SIZE;
+
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					perror("io_uring block I/O failed");
+					error = 1;
+				} else if (cqe->res < expected) {
+					if (batch->reqs[r].writing) {
+						fprintf(stderr, "io_uring block write was short\n");
+						error = 1;
+					} else {
+						zero_short_read(batch->reqs[r].nblocks, batch->reqs[r].iov, cqe->res);
+					}
+				}
+				head++;
+				pending--;
+			}
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+			if (pending > 0) {
+				int ret = syscall(__NR_io_uring_enter, ring.fd, 0, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+				if (ret < 0 && errno != EINTR) {
+					perror("io_uring wait failed");
+					error = 1;
+					break;
+				}
+			}
+		}
+		if (batch->submitted > 0) {
+			pthread_mutex_unlock(&ring_lock);
+		}
+    }
+#endif
+
+    bio_batch_init(batch);
+    return error ? -1 : 0;
+}
+
+/*
+ * Metadata journal
+ *
+ * A disk made with a journal sets nblocks blocks aside at start: a header
+ * block, then the log. Once dev_journal_open() has replayed it, dirty
+ * blocks in the cache no longer go home on their own. The file system
+ * groups its changes into transactions and calls dev_commit() when none is
+ * half done; every dirty block the log doesn't have yet is then appended to
+ * it with one sequential pwritev and synced:
+ *
+ *   descriptor | blocks it lists | descriptor | ... | commit record
+ *
+ * Descriptors list the home block numbers, then revoked ones: blocks that
+ * were logged earlier and have since been overwritten at home by
+ * bio_writev and friends, so replay must not bring the old copy back. The
+ * commit record has a checksum of the rest, so a torn commit is ignored.
+ *
+ * Logged blocks stay dirty in the cache and go home when convenient: on
+ * eviction, before they change again, or at a checkpoint, which writes all
+ * of them, syncs and empties the log. Dirty blocks the log doesn't have are
+ * never evicted; the cache grows past its size until the next commit.
+ *
+ * The mmap backend writes straight into the mapping, so it only replays,
+ * as does a mount that turned journaling off with dev_set_journaling().
+ */
+#define JOURNAL_MAGIC		0x4A524E4C	/* header */
+#define JOURNAL_DESC_MAGIC	0x4A445343	/* descriptor */
+#define JOURNAL_COMMIT_MAGIC	0x4A434D54	/* commit record */
+
+//Dirty blocks worth a commit without waiting for the next sync
+#define JOURNAL_BATCH	256
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t sequence;			/* transaction at the start of the log */
+};
+
+struct journal_desc {
+	uint32_t magic;
+	uint32_t sequence;			/* transaction it belongs to */
+	uint32_t count;				/* logged blocks that follow it */
+	uint32_t revokes;			/* revoked blocks listed after the logged ones */
+	uint32_t blocks[];
+};
+
+#define JOURNAL_DESC_ENTRIES	((int) ((BLOCK_SIZE - sizeof(struct journal_desc)) / sizeof(uint32_t)))
+
+struct journal_commit {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t length;			/* log blocks before the commit record */
+	uint32_t checksum;			/* journal_checksum() of those blocks */
+};
+
+#define JOURNAL_CHECKSUM_SEED	2166136261u
+
+//FNV-1a, a 32-bit word at a time
+static uint32_t journal_checksum(uint32_t hash, const void *block) {
+	const uint32_t *words = block;
+	for (int i = 0; i < BLOCK_SIZE / 4; i++) {
+		hash ^= words[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int journal_read(int block_num, void *buf) {
+	if (pread(diskfile, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE) != BLOCK_SIZE) {
+		return -1;
+	}
+	return 0;
+}
+
+//Point the header at sequence, with an empty log after it
+static int journal_write_header(int start, uint32_t sequence) {
+	unsigned char block[BLOCK_SIZE] = {0};
+	struct journal_header *header = (struct journal_header *) block;
+
+	header->magic = JOURNAL_MAGIC;
+	header->sequence = sequence;
+	if (pwrite(diskfile, block, BLOCK_SIZE, (off_t) start * BLOCK_SIZE) != BLOCK_SIZE || fdatasync(diskfile) < 0) {
+		perror("journal header write failed");
+		return -1;
+	}
+	return 0;
+}
+
+//Set up an empty journal in blocks [start, start + nblocks) of a new disk
+int dev_journal_create(int start, int nblocks) {
+	if (diskfile < 0 || start <= 0 || nblocks < 3 || start + nblocks > DISK_BLOCKS) {
+		return -1;
+	}
+	return journal_write_header(start, 1);
+}
+
+/*
+ * Copy the blocks of every complete transaction in the log home, oldest
+ * first, except the copies a later transaction revoked. *sequence moves past
+ * the last one. Returns the number of transactions replayed.
+ */
+static int journal_replay(int start, int nblocks, uint32_t *sequence) {
+	struct replay_copy {
+		int home;
+		int pos;
+		uint32_t sequence;
+	} *copies = NULL;
+	int copyCount = 0, copyCapacity = 0;
+	int *revokes = NULL;
+	int revokeCount = 0, revokeCapacity = 0;
+	int replayed = 0, ret = 0;
+	uint32_t block[BLOCK_SIZE / 4];
+
+	uint32_t *revokedBy = calloc(DISK_BLOCKS, sizeof(uint32_t));
+	if (revokedBy == NULL) {
+		return -1;
+	}
+
+	// Find where the complete transactions end.
+	int pos = 1;
+	while (pos < nblocks) {
+		int txnCopies = copyCount;
+		int complete = 0;
+		uint32_t hash = JOURNAL_CHECKSUM_SEED;
+		int p = pos;
+
+		revokeCount = 0;
+		while (p < nblocks && journal_read(start + p, block) == 0) {
+			struct journal_desc *desc = (struct journal_desc *) block;
+			struct journal_commit *commit = (struct journal_commit *) block;
+
+			if (commit->magic == JOURNAL_COMMIT_MAGIC && commit->sequence == *sequence) {
+				complete = (commit->length == (uint32_t) (p - pos) && commit->checksum == hash);
+				p++;
+				break;
+			}
+			if (desc->magic != JOURNAL_DESC_MAGIC || desc->sequence != *sequence ||
+			    desc->count + desc->revokes > (uint32_t) JOURNAL_DESC_ENTRIES || p + 1 + (int) desc->count >= nblocks) {
+				break;
+			}
+
+			if (copyCount + (int) desc->count > copyCapacity) {
+				copyCapacity = copyCapacity * 2 + desc->count;
+				void *more = realloc(copies, copyCapacity * sizeof(struct replay_copy));
+				if (more == NULL) {
+					ret = -1;
+					break;
+				}
+				copies = more;
+			}
+			if (revokeCount + (int) desc->revokes > revokeCapacity) {
+				revokeCapacity = revokeCapacity * 2 + desc->revokes;
+				void *more = realloc(revokes, revokeCapacity * sizeof(int));
+				if (more == NULL) {
+					ret = -1;
+					break;
+				}
+				revokes = more;
+			}
+
+			// Home blocks inside the journal can only be garbage.
+			int bad = 0;
+			for (uint32_t i = 0; i < desc->count + desc->revokes; i++) {
+				if (desc->blocks[i] >= (uint32_t) start) bad = 1;
+			}
+			if (bad) {
+				break;
+			}
+
+			for (uint32_t i = 0; i < desc->count; i++) {
+				copies[copyCount].home = desc->blocks[i];
+				copies[copyCount].pos = start + p + 1 + i;
+				copies[copyCount].sequence = *sequence;
+				copyCount++;
+			}
+			for (uint32_t i = 0; i < desc->revokes; i++) {
+				revokes[revokeCount++] = desc->blocks[desc->count + i];
+			}
+
+			int count = desc->count;
+			hash = journal_checksum(hash, block);
+			for (int i = 0; i < count; i++) {
+				if (journal_read(start + p + 1 + i, block) < 0) {
+					break;
+				}
+				hash = journal_checksum(hash, block);
+			}
+			p += 1 + count;
+		}
+
+		if (ret < 0 || !complete) {
+			copyCount = txnCopies;
+			break;
+		}
+		for (int i = 0; i < revokeCount; i++) {
+			revokedBy[revokes[i]] = *sequence;
+		}
+		pos = p;
+		(*sequence)++;
+		replayed++;
+	}
+
+	// Then put them back, newest copy last.
+	for (int i = 0; i < copyCount && ret == 0; i++) {
+		if (revokedBy[copies[i].home] > copies[i].sequence) {
+			continue;
+		}
+		if (journal_read(copies[i].pos, block) < 0 ||
+		    pwrite(diskfile, block, BLOCK_SIZE, (off_t) copies[i].home * BLOCK_SIZE) != BLOCK_SIZE) {
+			perror("journal replay failed");
+			ret = -1;
+		}
+	}
+	if (ret == 0 && replayed > 0 && fdatasync(diskfile) < 0) {
+		ret = -1;
+	}
+
+	free(copies);
+	free(revokes);
+	free(revokedBy);
+	return (ret < 0) ? -1 : replayed;
+}
+
+/*
+ * Replay the journal in blocks [start, start + nblocks) and use it from now
+ * on. Returns 1 when it is in use, 0 when the backend can't use it (mmap),
+ * and -1 if it is damaged or can't be read.
+ */
+int dev_journal_open(int start, int nblocks) {
+	uint32_t block[BLOCK_SIZE / 4];
+	struct journal_header *header = (struct journal_header *) block;
+
+	if (diskfile < 0 || start <= 0 || nblocks < 3 || start + nblocks > DISK_BLOCKS) {
+		return -1;
+	}
+	if (journal_read(start, block) < 0 || header->magic != JOURNAL_MAGIC) {
+		fprintf(stderr, "journal header is missing\n");
+		return -1;
+	}
+
+	uint32_t sequence = header->sequence;
+	int replayed = journal_replay(start, nblocks, &sequence);
+	if (replayed < 0) {
+		return -1;
+	}
+	if (replayed > 0) {
+		fprintf(stderr, "tfs: replayed %d journal transactions\n", replayed);
+		if (journal_write_header(start, sequence) < 0) {
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	memset(journal_logged, 0, sizeof(journal_logged));
+	memset(journal_revoked, 0, sizeof(journal_revoked));
+	revoke_count = 0;
+	journal_pending = 0;
+	journal_blocks = nblocks;
+	journal_next = 1;
+	journal_sequence = sequence;
+	journal_start = (diskmap == NULL && journal_wanted) ? start : 0;
+
+	// Cached copies of replayed blocks are out of date. Blocks already
+	// dirty go in the first transaction.
+	for (struct cache_block *cb = lru_head; cb != NULL; ) {
+		struct cache_block *next = cb->lru_next;
+		if (cb->block_num >= 0 && !cb->dirty && replayed > 0) {
+			cache_invalidate(cb);
+		} else if (cb->block_num >= 0 && cache_pinned(cb)) {
+			journal_pending++;
+		}
+		cb = next;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (diskmap != NULL && journal_wanted) {
+		fprintf(stderr, "tfs: the mmap backend writes in place; changes to this disk are not journaled\n");
+	}
+	return (journal_start > 0) ? 1 : 0;
 }
 
+//Write every logged block home, then empty the log
+static int journal_checkpoint_locked() {
+	int retstat = 0;
+
+	for (struct cache_block *cb = lru_head; cb != NULL; cb = cb->lru_next) {
+		if (cb->block_num >= 0 && cb->dirty && cb->logged && cache_writeback(cb) < 0) {
+			retstat = -1;
+		}
+	}
+	if (retstat < 0) {
+		return -1;
+	}
+	if (fdatasync(diskfile) < 0) {
+		perror("journal checkpoint failed");
+		return -1;
+	}
+	if (journal_write_header(journal_start, journal_sequence) < 0) {
+		return -1;
+	}
+
+	// Nothing in the log is left to revoke.
+	journal_next = 1;
+	memset(journal_logged, 0, sizeof(journal_logged));
+	memset(journal_revoked, 0, sizeof(journal_revoked));
+	revoke_count = 0;
+	return 0;
+}
+
+//A transaction larger than the whole log goes home directly, unprotected
+static int journal_overflow_locked() {
+	int retstat = 0;
+
+	fprintf(stderr, "tfs: %d dirty blocks don't fit in the journal\n", journal_pending);
+	for (struct cache_block *cb = lru_head; cb != NULL; cb = cb->lru_next) {
+		if (cb->block_num >= 0 && cb->dirty && cache_writeback(cb) < 0) {
+			retstat = -1;
+		}
+	}
+	if (retstat == 0 && fdatasync(diskfile) < 0) {
+		retstat = -1;
+	}
+	return retstat;
+}
+
+static int journal_commit_locked() {
+	int logCount = journal_pending;
+	int needed = (logCount + revoke_count + JOURNAL_DESC_ENTRIES - 1) / JOURNAL_DESC_ENTRIES + logCount + 1;
+
+	if (logCount == 0 && revoke_count == 0) {
+		return 0;
+	}
+	if (journal_next + needed > journal_blocks && journal_checkpoint_locked() < 0) {
+		return -1;
+	}
+	if (1 + needed > journal_blocks) {
+		return journal_overflow_locked();
+	}
+
+	// Blocks logged now are newer than any revoke of them.
+	struct cache_block **logged = malloc((logCount + 1) * sizeof(struct cache_block *));
+	if (logCount > 0 && logged == NULL) {
+		return -1;
+	}
+	int count = 0;
+	for (struct cache_block *cb = lru_head; cb != NULL && count < logCount; cb = cb->lru_next) {
+		if (cb->block_num >= 0 && cache_pinned(cb)) {
+			logged[count++] = cb;
+			journal_revoked[cb->block_num / 8] &= ~(1 << (cb->block_num & 7));
+		}
+	}
+	int revokes = 0;
+	for (int i = 0; i < revoke_count; i++) {
+		if (block_bit(journal_revoked, revoke_list[i])) {
+			revoke_list[revokes++] = revoke_list[i];
+		}
+	}
+
+	int descCount = (count + revokes + JOURNAL_DESC_ENTRIES - 1) / JOURNAL_DESC_ENTRIES;
+	if (descCount == 0) descCount = 1;
+	int length = descCount + count;
+	unsigned char *descs = calloc(descCount + 1, BLOCK_SIZE);
+	struct iovec *iov = malloc((length + 1) * sizeof(struct iovec));
+	if (descs == NULL || iov == NULL) {
+		free(logged);
+		free(descs);
+		free(iov);
+		return -1;
+	}
+
+	// Each descriptor is followed by the blocks it lists. Logged blocks fill
+	// the descriptors first, revokes take the space left.
+	uint32_t hash = JOURNAL_CHECKSUM_SEED;
+	int nextLogged = 0, nextRevoke = 0, n = 0;
+	for (int d = 0; d < descCount; d++) {
+		struct journal_desc *desc = (struct journal_desc *) (descs + (size_t) d * BLOCK_SIZE);
+		desc->magic = JOURNAL_DESC_MAGIC;
+		desc->sequence = journal_sequence;
+		while (desc->count < (uint32_t) JOURNAL_DESC_ENTRIES && nextLogged < count) {
+			desc->blocks[desc->count++] = logged[nextLogged++]->block_num;
+		}
+		while (desc->count + desc->revokes < (uint32_t) JOURNAL_DESC_ENTRIES && nextRevoke < revokes) {
+			desc->blocks[desc->count + desc->revokes++] = revoke_list[nextRevoke++];
+		}
+
+		iov[n].iov_base = desc;
+		iov[n++].iov_len = BLOCK_SIZE;
+		hash = journal_checksum(hash, desc);
+		for (uint32_t i = 0; i < desc->count; i++) {
+			struct cache_block *cb = logged[nextLogged - desc->count + i];
+			iov[n].iov_base = cb->data;
+			iov[n++].iov_len = BLOCK_SIZE;
+			hash = journal_checksum(hash, cb->data);
+		}
+	}
+
+	struct journal_commit *commit = (struct journal_commit *) (descs + (size_t) descCount * BLOCK_SIZE);
+	commit->magic = JOURNAL_COMMIT_MAGIC;
+	commit->sequence = journal_sequence;
+	commit->length = length;
+	commit->checksum = hash;
+	iov[n].iov_base = commit;
+	iov[n++].iov_len = BLOCK_SIZE;
+
+	int retstat = dev_pwritev(journal_start + journal_next, n, iov);
+	if (retstat == 0 && fdatasync(diskfile) < 0) {
+		perror("journal commit failed");
+		retstat = -1;
+	}
+
+	if (retstat == 0) {
+		for (int i = 0; i < count; i++) {
+			logged[i]->logged = 1;
+			journal_logged[logged[i]->block_num / 8] |= 1 << (logged[i]->block_num & 7);
+		}
+		journal_pending -= count;
+		for (int i = 0; i < revokes; i++) {
+			journal_revoked[revoke_list[i] / 8] &= ~(1 << (revoke_list[i] & 7));
+		}
+		revoke_count = 0;
+		journal_next += n;
+		journal_sequence++;
+	} else {
+		revoke_count = revokes;
+	}
+
+	free(logged);
+	free(descs);
+	free(iov);
+	return retstat;
+}
+
+/*
+ * Commit every change made since the last commit as one transaction. The
+ * caller keeps new changes from starting until it returns. Without a
+ * journal this is dev_flush().
+ */
+int dev_commit() {
+	if (journal_start == 0) {
+		return dev_flush();
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	int retstat = journal_commit_locked();
+	pthread_mutex_unlock(&cache_lock);
+	return retstat;
+}
+
+//Write the logged blocks home and empty the log; unless force, only once it is half full
+int dev_checkpoint(int force) {
+	int retstat = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (journal_start > 0 && (force || journal_next > journal_blocks / 2)) {
+		retstat = journal_checkpoint_locked();
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return retstat;
+}
+
+//Whether enough dirty blocks wait for the log that a commit shouldn't wait
+int dev_journal_pressure() {
+	pthread_mutex_lock(&cache_lock);
+	int pressure = journal_start > 0 && (journal_pending >= JOURNAL_BATCH || journal_pending >= cache_size / 2);
+	pthread_mutex_unlock(&cache_lock);
+	return pressure;
+}
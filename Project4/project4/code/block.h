@@ -12,12 +12,70 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 4096
 
+//Disk size set to 32MB
+#define DISK_SIZE	(32*1024*1024)
+#define DISK_BLOCKS	(DISK_SIZE / BLOCK_SIZE)
+
+// Default number of blocks held by the buffer cache (4MB)
+#define BLOCK_CACHE_SIZE 1024
+
+// Device backends, picked with dev_set_backend() before the disk is opened
+#define DEV_BACKEND_PREAD	0	/* pread/pwrite through the block cache */
+#define DEV_BACKEND_MMAP	1	/* the disk file mapped into memory */
+#define DEV_BACKEND_URING	2	/* pread backend, with batches sent through io_uring */
+
+// Most requests a bio_batch holds; a full batch is submitted on its own
+#define BIO_BATCH_MAX 64
+
+struct bio_batch {
+	int count;				/* requests queued */
+	int submitted;				/* requests already started */
+	int inflight;				/* started ones the ring still has */
+	int error;				/* a request failed */
+	struct {
+		int block_num;			/* first block of the run */
+		int nblocks;			/* blocks in the run, one iovec each */
+		const struct iovec *iov;
+		int writing;
+	} reqs[BIO_BATCH_MAX];
+};
+
+struct cache_stats {
+	unsigned long hits;			/* lookups served from the cache */
+	unsigned long misses;			/* lookups that needed a cache slot */
+	unsigned long writebacks;		/* dirty blocks written to the disk file */
+	unsigned long evictions;		/* blocks dropped to make room */
+};
+
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
+int dev_flush();
+int dev_commit();
+int dev_checkpoint(int force);
+int dev_journal_create(int start, int nblocks);
+int dev_journal_open(int start, int nblocks);
+int dev_journal_pressure();
+void dev_set_cache_size(int nblocks);
+void dev_set_backend(int which);
+void dev_set_journaling(int on);
+int dev_get_backend();
+void dev_cache_stats(struct cache_stats *out);
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+void *bio_map(const int block_num);
+int bio_fd(const int block_num, const int count, int writing, off_t *pos);
+int bio_prefetch(const int block_num, const int count);
+int bio_readv(const int block_num, const int count, const struct iovec *iov);
+int bio_writev(const int block_num, const int count, const struct iovec *iov);
+void bio_batch_init(struct bio_batch *batch);
+int bio_batch_readv(struct bio_batch *batch, const int block_num, const int count, const struct iovec *iov);
+int bio_batch_writev(struct bio_batch *batch, const int block_num, const int count, const struct iovec *iov);
+int bio_batch_submit(struct bio_batch *batch);
+int bio_batch_wait(struct bio_batch *batch);
 
 #endif
@@ -10,6 +10,8 @@
  */
 
 #include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -20,6 +22,13 @@
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
+#define FILE 1
+#define DIRECTORY 2
+#define ROOT_INODE 2
+
+// Blocks set aside at the end of the disk by mkfs for the metadata journal
+#define JOURNAL_BLOCKS 512
+
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
@@ -29,8 +38,13 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start address of data block bitmap */
 	uint32_t	i_start_blk;		/* start address of inode region */
 	uint32_t	d_start_blk;		/* start address of data block region */
+	uint32_t	j_start_blk;		/* start address of the journal */
+	uint32_t	j_blocks;			/* journal size, 0 on disks made without one */
 };
 
+// Block pointer flag: preallocated by fallocate(), reads as zeros until written
+#define BLOCK_UNWRITTEN 0x40000000
+
 struct inode {
 	uint16_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
@@ -48,22 +62,185 @@ struct dirent {
 	char name[252];					/* name of the directory entry */
 };
 
+/*
+ * Hashed directory index. Block 0 of an indexed directory holds this header
+ * and an extendible hash table; slot (hash & ((1 << depth) - 1)) names the
+ * leaf block holding that name. Leaves hold packed struct dir_entry records.
+ * A block 0 without the magic number is an old linear directory of fixed
+ * struct dirent slots.
+ */
+#define DIR_INDEX_MAGIC		0x54484458
+#define DIR_INDEX_MAX_DEPTH	9		/* 512 slots fit in the index block */
+#define DIR_LEAF_MASK		0x00FFFFFF	/* slot: directory block of the leaf */
+#define DIR_DEPTH_SHIFT		24		/* slot: local depth of the leaf */
+
+struct dir_index {
+	uint32_t	magic;				/* DIR_INDEX_MAGIC */
+	uint16_t	depth;				/* the table has 1 << depth slots */
+	uint16_t	leaf_count;			/* leaves are directory blocks 1..leaf_count */
+	uint32_t	table[];			/* leaf block | local depth << DIR_DEPTH_SHIFT */
+};
+
+/*
+ * Directory entry in a leaf of an indexed directory. Records are packed from
+ * the start of the block with no gaps; a rec_len of 0 marks the end.
+ */
+struct dir_entry {
+	uint16_t	ino;				/* inode number of the directory entry */
+	uint16_t	rec_len;			/* length of this record */
+	uint8_t		name_len;			/* length of the name, without the NUL */
+	uint8_t		file_type;			/* type of the inode (FILE or DIRECTORY) */
+	char		name[];				/* NUL terminated name */
+};
+
+#define DIR_REC_LEN(name_len)	((sizeof(struct dir_entry) + (name_len) + 1 + 3) & ~3)
+
+/*
+ * How long the kernel may cache names and attributes, in seconds, and
+ * whether it keeps a file's pages across opens. Set from -o cache=.
+ */
+struct cache_policy {
+	double		entryTimeout;		/* names found by lookup */
+	double		attrTimeout;		/* attributes */
+	double		negativeTimeout;	/* names lookup didn't find */
+	int		keepCache;			/* fuse_file_info->keep_cache on open */
+};
+
+extern struct cache_policy CachePolicy;
+
+/*
+ * An open file, kept by the FUSE frontends in fuse_file_info->fh.
+ */
+struct open_file {
+	struct inode	*inode;				/* pinned with iget() until release */
+	pthread_mutex_t	raLock;				/* covers the four below; reads may run at once */
+	off_t		nextOffset;			/* where the last read or write ended */
+	int		sequential;			/* accesses in a row that started at nextOffset */
+	int		raWindow;			/* blocks read ahead at a time, 0 for random access */
+	int		raNext;				/* first file block not read ahead yet */
+	struct write_buffer *wb;			/* small writes not on disk yet, or NULL */
+};
+
+
+/*
+ * File system core, shared by the high-level (tfs.c) and low-level
+ * (tfs_ll.c) FUSE frontends. name_len counts the terminating NUL.
+ */
+int tfs_mount(void);
+void tfs_unmount(void);
+int tfs_sync(void);
+void txn_begin(void);
+void txn_end(void);
+
+struct fuse_conn_info;
+void tfs_negotiate(struct fuse_conn_info *conn);
+
+int readi(uint16_t ino, struct inode *inode);
+int writei(uint16_t ino, struct inode *inode);
+struct inode *iget(uint16_t ino);
+void iput(struct inode *inode);
+void mark_inode_dirty(struct inode *inode);
+void inode_lock(struct inode *inode, int exclusive);
+void inode_unlock(struct inode *inode);
+int inode_stat(uint16_t ino, struct stat *stbuf);
+
+int lookup_name(uint16_t dir, const char *fname, size_t name_len, uint16_t *ino);
+int dir_iterate(struct inode *dir, int (*filler)(void *arg, uint16_t ino, const char *name, int type), void *arg);
+int node_create(uint16_t parent, const char *name, size_t name_len, int type, struct inode *newInode);
+int node_remove(uint16_t parent, const char *name, size_t name_len, int type);
+
+struct fuse_bufvec;
+
+struct open_file *open_file_new(uint16_t ino);
+void open_file_free(struct open_file *file);
+void open_file_access(struct open_file *file, off_t offset, size_t size);
+void open_file_readahead(struct open_file *file, off_t offset, size_t size);
+int open_file_write(struct open_file *file, const char *buffer, size_t size, off_t offset);
+int open_file_write_buf(struct open_file *file, struct fuse_bufvec *buf, off_t offset);
+int open_file_flush(struct open_file *file);
+int open_file_writeback(struct open_file *file);
+int open_file_sync(struct open_file *file);
+int open_file_truncate(struct open_file *file, off_t size);
+int open_file_fallocate(struct open_file *file, int mode, off_t offset, off_t length);
+int inode_lock_read(struct inode *inode);
+int file_read(struct inode *fileInode, char *buffer, size_t size, off_t offset);
+int file_write(struct inode *fileInode, const char *buffer, size_t size, off_t offset);
+int file_read_buf(struct inode *fileInode, struct fuse_bufvec **bufp, size_t size, off_t offset, int splice);
+int hold_freed_blocks();
+void unhold_freed_blocks(int epoch);
+int file_write_buf(struct inode *fileInode, struct fuse_bufvec *buf, off_t offset);
+int file_truncate(struct inode *fileInode, off_t size);
+int file_punch_hole(struct inode *fileInode, off_t offset, off_t length);
+int file_preallocate(struct inode *fileInode, off_t offset, off_t length, int keepSize);
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+/*
+ * Word-at-a-time helpers. Bit i lives in byte i / 8, so on a little-endian
+ * host it is also bit (i % 64) of 64-bit word i / 64. The bitmap must be
+ * 8-byte aligned.
+ */
+
+// Find the first clear bit in [start, end). Returns -1 if all are set.
+static inline int find_clear_bit(bitmap_t b, int start, int end) {
+    const uint64_t *words = (const uint64_t *) b;
+    int i = start;
+
+    while (i < end) {
+        uint64_t free = ~words[i / 64] >> (i & 63);
+        if (free != 0) {
+            i += __builtin_ctzll(free);
+            return (i < end) ? i : -1;
+        }
+        i = (i | 63) + 1;
+    }
+    return -1;
+}
+
+// Find the first set bit in [start, end). Returns end if all are clear.
+static inline int find_set_bit(bitmap_t b, int start, int end) {
+    const uint64_t *words = (const uint64_t *) b;
+    int i = start;
+
+    while (i < end) {
+        uint64_t used = words[i / 64] >> (i & 63);
+        if (used != 0) {
+            i += __builtin_ctzll(used);
+            return (i < end) ? i : end;
+        }
+        i = (i | 63) + 1;
+    }
+    return end;
+}
+
+// Count the set bits in [0, nbits).
+static inline int count_set_bits(bitmap_t b, int nbits) {
+    const uint64_t *words = (const uint64_t *) b;
+    int count = 0;
+
+    for (int w = 0; w < nbits / 64; w++) {
+        count += __builtin_popcountll(words[w]);
+    }
+    if (nbits & 63) {
+        count += __builtin_popcountll(words[nbits / 64] & ((1ULL << (nbits & 63)) - 1));
+    }
+    return count;
+}
+
 #endif
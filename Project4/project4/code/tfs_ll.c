@@ -0,0 +1,413 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	tfs_ll.c
+ *
+ * Low-level FUSE frontend, selected with -o lowlevel. Requests name files by
+ * inode number instead of by path, so these operations drive the core in
+ * tfs.c (readi(), lookup_name(), node_create(), ...) directly, without the
+ * path walks and dirname()/basename() copies of the high-level frontend.
+ *
+ * FUSE numbers the root directory FUSE_ROOT_ID (1); every other inode keeps
+ * its TFS number. Inode 1 is reserved in TFS, so the two never clash.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "block.h"
+#include "tfs.h"
+
+static uint16_t tfs_ino(fuse_ino_t ino) {
+        return (ino == FUSE_ROOT_ID) ? ROOT_INODE : (uint16_t) ino;
+}
+
+static fuse_ino_t fuse_ino(uint16_t ino) {
+        return (ino == ROOT_INODE) ? FUSE_ROOT_ID : ino;
+}
+
+// Attributes of inode ino as FUSE wants them. Returns -1 if there is no such inode.
+static int ll_stat(uint16_t ino, struct stat *stbuf) {
+        if (inode_stat(ino, stbuf) != 0) {return -1;}
+        stbuf->st_ino = fuse_ino(ino);
+        return 0;
+}
+
+static int ll_entry(uint16_t ino, struct fuse_entry_param *entry) {
+        memset(entry, 0, sizeof(struct fuse_entry_param));
+        entry->ino           = fuse_ino(ino);
+        entry->attr_timeout  = CachePolicy.attrTimeout;
+        entry->entry_timeout = CachePolicy.entryTimeout;
+        return ll_stat(ino, &entry->attr);
+}
+
+// name_len as the core counts it, or -1 if the name is too long for a directory entry.
+static int ll_name_len(const char *name) {
+        size_t len = strnlen(name, 256);
+        return (len > 255) ? -1 : (int) len + 1;
+}
+
+static void tfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+        if (tfs_mount() != 0) {
+                exit(EXIT_FAILURE);
+        }
+        tfs_negotiate(conn);
+}
+
+static void tfs_ll_destroy(void *userdata) {
+        tfs_unmount();
+}
+
+static void tfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+        int name_len = ll_name_len(name);
+        if (name_len < 0) {
+                fuse_reply_err(req, ENAMETOOLONG);
+                return;
+        }
+
+        uint16_t ino = 0;
+        struct fuse_entry_param entry;
+        if (lookup_name(tfs_ino(parent), name, name_len, &ino) != 0 || ll_entry(ino, &entry) != 0) {
+                // An entry with inode 0 lets the kernel cache the miss.
+                if (CachePolicy.negativeTimeout > 0) {
+                        memset(&entry, 0, sizeof(struct fuse_entry_param));
+                        entry.entry_timeout = CachePolicy.negativeTimeout;
+                        fuse_reply_entry(req, &entry);
+                        return;
+                }
+                fuse_reply_err(req, ENOENT);
+                return;
+        }
+        fuse_reply_entry(req, &entry);
+}
+
+static void tfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+        // Lookups don't pin anything, so there is nothing to drop. Once an
+        // unlinked inode is freed it reads as invalid, and getattr() fails.
+        fuse_reply_none(req);
+}
+
+static void tfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        struct stat stbuf;
+        if (ll_stat(tfs_ino(ino), &stbuf) != 0) {
+                fuse_reply_err(req, ENOENT);
+                return;
+        }
+        fuse_reply_attr(req, &stbuf, CachePolicy.attrTimeout);
+}
+
+/*
+ * Run op on the file open as fi, or on ino opened just for the call when
+ * the kernel didn't pass a handle. Returns 0 or a negative errno.
+ */
+static int ll_file_change(fuse_ino_t ino, struct fuse_file_info *fi, int (*op)(struct open_file *, off_t, off_t), off_t a, off_t b) {
+        if (fi != NULL && fi->fh != 0) {
+                return op((struct open_file *) (uintptr_t) fi->fh, a, b);
+        }
+
+        struct open_file *file = open_file_new(tfs_ino(ino));
+        if (file == NULL) {return -ENOENT;}
+        int ret = op(file, a, b);
+        open_file_free(file);
+        return ret;
+}
+
+static int ll_truncate(struct open_file *file, off_t size, off_t unused) {
+        return open_file_truncate(file, size);
+}
+
+static void tfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+        // Only the size is applied; like utimens() in the high-level
+        // frontend, other changes are accepted but not applied.
+        if (to_set & FUSE_SET_ATTR_SIZE) {
+                int ret = ll_file_change(ino, fi, ll_truncate, attr->st_size, 0);
+                if (ret != 0) {
+                        fuse_reply_err(req, -ret);
+                        return;
+                }
+        }
+        tfs_ll_getattr(req, ino, fi);
+}
+
+static void ll_create_node(fuse_req_t req, fuse_ino_t parent, const char *name, int type, struct fuse_file_info *fi) {
+        int name_len = ll_name_len(name);
+        if (name_len < 0) {
+                fuse_reply_err(req, ENAMETOOLONG);
+                return;
+        }
+
+        uint16_t ino = 0;
+        if (lookup_name(tfs_ino(parent), name, name_len, &ino) == 0) {
+                fuse_reply_err(req, EEXIST);
+                return;
+        }
+
+        struct inode newInode = {0};
+        struct fuse_entry_param entry;
+        int ret = node_create(tfs_ino(parent), name, name_len, type, &newInode);
+        if (ret == 0 && ll_entry(newInode.ino, &entry) != 0) {ret = -EIO;}
+        if (ret != 0) {
+                fuse_reply_err(req, -ret);
+                return;
+        }
+
+        if (fi == NULL) {
+                fuse_reply_entry(req, &entry);
+                return;
+        }
+
+        // create() also opens the file.
+        struct open_file *file = open_file_new(newInode.ino);
+        if (file == NULL) {
+                fuse_reply_err(req, ENFILE);
+                return;
+        }
+        fi->fh = (uint64_t) (uintptr_t) file;
+        fi->keep_cache = CachePolicy.keepCache;
+        fuse_reply_create(req, &entry, fi);
+}
+
+static void tfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+        ll_create_node(req, parent, name, DIRECTORY, NULL);
+}
+
+static void tfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+        ll_create_node(req, parent, name, FILE, fi);
+}
+
+static void ll_remove_node(fuse_req_t req, fuse_ino_t parent, const char *name, int type) {
+        int name_len = ll_name_len(name);
+        if (name_len < 0) {
+                fuse_reply_err(req, ENAMETOOLONG);
+                return;
+        }
+        fuse_reply_err(req, -node_remove(tfs_ino(parent), name, name_len, type));
+}
+
+static void tfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+        ll_remove_node(req, parent, name, FILE);
+}
+
+static void tfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+        ll_remove_node(req, parent, name, DIRECTORY);
+}
+
+static void tfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        struct open_file *file = open_file_new(tfs_ino(ino));
+        if (file == NULL) {
+                fuse_reply_err(req, ENFILE);
+                return;
+        }
+        fi->fh = (uint64_t) (uintptr_t) file;
+        fi->keep_cache = CachePolicy.keepCache;
+        fuse_reply_open(req, fi);
+}
+
+// Whole blocks are replied as pieces of DISKFILE, which the kernel can splice.
+static void tfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+        struct open_file *file = (struct open_file *) (uintptr_t) fi->fh;
+        struct fuse_bufvec *bufv = NULL;
+
+        if (inode_lock_read(file->inode) != 0) {
+                fuse_reply_err(req, EIO);
+                return;
+        }
+        open_file_access(file, off, size);
+        open_file_readahead(file, off, size);
+        int epoch = hold_freed_blocks();
+        int ret = file_read_buf(file->inode, &bufv, size, off, 1);
+        inode_unlock(file->inode);
+        if (ret < 0) {
+                unhold_freed_blocks(epoch);
+                fuse_reply_err(req, EIO);
+                return;
+        }
+
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        unhold_freed_blocks(epoch);
+        for (size_t i = 0; i < bufv->count; i++) {
+                free(bufv->buf[i].mem);
+        }
+        free(bufv);
+}
+
+static void tfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+        struct open_file *file = (struct open_file *) (uintptr_t) fi->fh;
+
+        txn_begin();
+        inode_lock(file->inode, 1);
+        open_file_access(file, off, fuse_buf_size(bufv));
+        int ret = open_file_write_buf(file, bufv, off);
+        mark_inode_dirty(file->inode);
+        inode_unlock(file->inode);
+        txn_end();
+        if (ret < 0) {
+                fuse_reply_err(req, EIO);
+        } else {
+                fuse_reply_write(req, ret);
+        }
+}
+
+static void tfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        // Buffered writes only; commits are left to fsync() and the journal.
+        fuse_reply_err(req, (open_file_writeback((struct open_file *) (uintptr_t) fi->fh) != 0) ? EIO : 0);
+}
+
+static void tfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+        fuse_reply_err(req, (open_file_sync((struct open_file *) (uintptr_t) fi->fh) != 0) ? EIO : 0);
+}
+
+static void tfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+        struct open_file *file = (struct open_file *) (uintptr_t) fi->fh;
+        fuse_reply_err(req, -open_file_fallocate(file, mode, offset, length));
+}
+
+static void tfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        open_file_free((struct open_file *) (uintptr_t) fi->fh);
+        fuse_reply_err(req, 0);
+}
+
+/*
+ * readdir() is called repeatedly with growing offsets. The whole listing is
+ * built once, on the first call, and kept with the open directory; each call
+ * hands out the part that fits.
+ */
+struct dir_listing {
+        fuse_req_t req;
+        char *buffer;
+        size_t size;
+        size_t capacity;
+};
+
+static int listing_add(void *arg, uint16_t ino, const char *name, int type) {
+        struct dir_listing *listing = arg;
+
+        // Pass the type along when the directory recorded it.
+        struct stat entryStat = {0};
+        entryStat.st_ino  = fuse_ino(ino);
+        entryStat.st_mode = (type == DIRECTORY) ? S_IFDIR : ((type == FILE) ? S_IFREG : 0);
+
+        size_t entrySize = fuse_add_direntry(listing->req, NULL, 0, name, NULL, 0);
+        if (listing->size + entrySize > listing->capacity) {
+                size_t capacity = (listing->capacity != 0) ? listing->capacity * 2 : BLOCK_SIZE;
+                while (capacity < listing->size + entrySize) {capacity *= 2;}
+
+                char *buffer = realloc(listing->buffer, capacity);
+                if (buffer == NULL) {return -1;}
+                listing->buffer   = buffer;
+                listing->capacity = capacity;
+        }
+
+        fuse_add_direntry(listing->req, listing->buffer + listing->size, entrySize, name, &entryStat,
+                          listing->size + entrySize);
+        listing->size += entrySize;
+        return 0;
+}
+
+static void tfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        struct dir_listing *listing = calloc(1, sizeof(struct dir_listing));
+        if (listing == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+        fi->fh = (uint64_t) (uintptr_t) listing;
+        fuse_reply_open(req, fi);
+}
+
+static void tfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+        struct dir_listing *listing = (struct dir_listing *) (uintptr_t) fi->fh;
+
+        if (off == 0) {
+                struct inode dir = {0};
+                if (readi(tfs_ino(ino), &dir) != 0) {
+                        fuse_reply_err(req, ENOENT);
+                        return;
+                }
+
+                listing->req  = req;
+                listing->size = 0;
+                if (dir_iterate(&dir, listing_add, listing) != 0) {
+                        fuse_reply_err(req, EIO);
+                        return;
+                }
+        }
+
+        if ((size_t) off >= listing->size) {
+                fuse_reply_buf(req, NULL, 0);
+                return;
+        }
+
+        // Entries are packed back to back, and off is always where one starts.
+        size_t remaining = listing->size - off;
+        fuse_reply_buf(req, listing->buffer + off, (remaining < size) ? remaining : size);
+}
+
+static void tfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        struct dir_listing *listing = (struct dir_listing *) (uintptr_t) fi->fh;
+        free(listing->buffer);
+        free(listing);
+        fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops tfs_ll_ope = {
+	.init		= tfs_ll_init,
+	.destroy	= tfs_ll_destroy,
+
+	.lookup		= tfs_ll_lookup,
+	.forget		= tfs_ll_forget,
+	.getattr	= tfs_ll_getattr,
+	.setattr	= tfs_ll_setattr,
+	.opendir	= tfs_ll_opendir,
+	.readdir	= tfs_ll_readdir,
+	.releasedir	= tfs_ll_releasedir,
+	.mkdir		= tfs_ll_mkdir,
+	.rmdir		= tfs_ll_rmdir,
+
+	.create		= tfs_ll_create,
+	.open		= tfs_ll_open,
+	.read		= tfs_ll_read,
+	.write_buf	= tfs_ll_write_buf,
+	.unlink		= tfs_ll_unlink,
+
+	.flush		= tfs_ll_flush,
+	.fsync		= tfs_ll_fsync,
+	.fallocate	= tfs_ll_fallocate,
+	.release	= tfs_ll_release
+};
+
+/*
+ * Mount with the low-level frontend and serve requests until unmounted.
+ * args holds the command line with TFS's own options already removed.
+ */
+int tfs_ll_main(struct fuse_args *args) {
+        char *mountpoint = NULL;
+        int multithreaded = 0;
+        int foreground = 0;
+        int err = -1;
+
+        if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {return 1;}
+
+        struct fuse_chan *chan = fuse_mount(mountpoint, args);
+        if (chan != NULL) {
+                struct fuse_session *session = fuse_lowlevel_new(args, &tfs_ll_ope, sizeof(tfs_ll_ope), NULL);
+                if (session != NULL) {
+                        if (fuse_set_signal_handlers(session) != -1 && fuse_daemonize(foreground) != -1) {
+                                fuse_session_add_chan(session, chan);
+                                // One thread per request unless -s was given.
+                                err = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                                fuse_remove_signal_handlers(session);
+                                fuse_session_remove_chan(chan);
+                        }
+                        fuse_session_destroy(session);
+                }
+                fuse_unmount(mountpoint, chan);
+        }
+        free(mountpoint);
+
+        return (err != 0) ? 1 : 0;
+}